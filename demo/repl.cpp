@@ -1,11 +1,25 @@
 #include <powerz/kt001.h>
 #include <powerz/serial.h>
+#include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include <csignal>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <sstream>
 #include <string>
 #include <utility>
 
@@ -28,32 +42,468 @@ void unwrap_inverse(optional<SystemError> maybe_err) {
     }
 }
 
+void print_usage(const char *argv0) {
+    cerr << "Usage: " << argv0 << " <tty_device> [options]\n"
+         << "Without options an interactive prompt is started.\n"
+         << "Batch options:\n"
+         << "  -b <script>  run commands from <script> ('-' for stdin)\n"
+         << "  -n <count>   sample <count> readings\n"
+         << "  -t <secs>    sample for <secs> seconds\n"
+         << "  -r <hz>      sampling rate, 0 for as fast as possible "
+            "(default)\n"
+         << "  -f csv|bin   reading output format (default csv)\n"
+         << "  -o <file>    reading output file ('-' for stdout, default)\n"
+         << "  -s <file>    take a screenshot into <file>\n"
+         << "  -S           print reading statistics to stderr at the end\n"
+         << "-f, -o and -r are applied before the script and may be "
+            "overridden by it;\n"
+         << "-n, -t and -s run after the script, in the order given.\n"
+         << "Script commands, one per line ('#' starts a comment):\n"
+         << "  format csv|bin, output <file>, rate <hz>, sample <count>,\n"
+         << "  sample_for <secs>, screenshot [file], stats, reset_stats, "
+            "exit\n"
+         << "Binary records are packed, host byte order: uint64 microseconds "
+            "since\n"
+         << "batch start followed by five float32 fields in the CSV order."
+         << endl;
+}
+
+// Write `ss` as a plain PPM image. Returns false on I/O failure.
+bool write_screenshot(const KT001::Screenshot &ss, const string &filename) {
+    ofstream img(filename.c_str());
+    img << "P3\n";
+    img << ss.width << " " << ss.height << "\n";
+    img << "255\n";
+    for (size_t y = 0; y < ss.height; y++) {
+        for (size_t x = 0; x < ss.width; x++) {
+            size_t idx = y * ss.width + x;
+            img << static_cast<int>(ss.data[idx * 3]) << " "
+                << static_cast<int>(ss.data[idx * 3 + 1]) << " "
+                << static_cast<int>(ss.data[idx * 3 + 2]) << "\n";
+        }
+    }
+    img.close();
+    return !img.fail();
+}
+
+string screenshot_filename() {
+    char time_str[80];
+    time_t t = time(nullptr);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d-%H%M%S", localtime(&t));
+    return string{time_str} + ".ppm";
+}
+
+// Returns true if a line is waiting on stdin, without blocking. Only looks at
+// the fd, so stdin must be unbuffered for typed-ahead input to be seen.
+bool stdin_ready() {
+    pollfd pfd{STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Signal that interrupted batch mode, or 0.
+volatile sig_atomic_t g_batch_signal = 0;
+
+void batch_signal_handler(int sig) { g_batch_signal = sig; }
+
+struct BinaryRecord {
+    uint64_t time_us;
+    MeterReading reading;
+} __attribute__((packed));
+static_assert(sizeof(BinaryRecord) == 28);
+
+struct FieldStats {
+    double min = numeric_limits<double>::infinity();
+    double max = -numeric_limits<double>::infinity();
+    double sum = 0;
+
+    void Add(double v) {
+        min = std::min(min, v);
+        max = std::max(max, v);
+        sum += v;
+    }
+};
+
+// Drives a connected KT001 from script commands and writes readings to a
+// fully buffered stdio stream, so that sampling is bounded by the device
+// rather than by formatting or flushing.
+class Batch {
+  public:
+    enum class Format { CSV, BINARY };
+
+    explicit Batch(KT001 *kt001)
+        : kt001_(kt001), start_(chrono::steady_clock::now()) {}
+
+    ~Batch() { CloseOutput(); }
+
+    bool SetFormat(const string &fmt) {
+        Format f;
+        if (fmt == "csv") {
+            f = Format::CSV;
+        } else if (fmt == "bin") {
+            f = Format::BINARY;
+        } else {
+            return false;
+        }
+        if (f != format_) header_written_ = false;
+        format_ = f;
+        return true;
+    }
+
+    void SetOutput(const string &path) {
+        if (out_ != nullptr && path == out_path_) return;
+        if (out_path_ == "-") stdout_header_written_ = header_written_;
+        if (!CloseOutput()) Fail("failed to write readings", errno);
+        // stdout is duplicated so it can be given our own buffer and closed
+        // like any other file.
+        out_ = path == "-" ? fdopen(dup(STDOUT_FILENO), "wb")
+                           : fopen(path.c_str(), "wb");
+        if (out_ == nullptr) Fail("failed to open " + path, errno);
+        buf_ = make_unique<char[]>(kOutputBufferSize);
+        setvbuf(out_, buf_.get(), _IOFBF, kOutputBufferSize);
+        out_path_ = path;
+        // Files are truncated, but stdout may already carry a header.
+        header_written_ = path == "-" && stdout_header_written_;
+    }
+
+    void SetRate(double hz) { rate_hz_ = hz; }
+
+    // Take `count` readings, or as many as fit in `duration_s` seconds if
+    // `count` is 0. Stops early, flushes and exits on SIGINT/SIGTERM.
+    void Sample(uint64_t count, double duration_s = 0) {
+        if (out_ == nullptr) SetOutput("-");
+        auto now = chrono::steady_clock::now;
+        auto period = chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(rate_hz_ > 0 ? 1 / rate_hz_ : 0));
+        auto end = now() +
+                   chrono::duration_cast<chrono::steady_clock::duration>(
+                       chrono::duration<double>(duration_s));
+        auto next = now();
+        chrono::steady_clock::time_point first, last;
+        uint64_t i = 0;
+        SystemError sys_err{};
+        for (; (count == 0 || i < count) && !g_batch_signal; i++) {
+            if (count == 0 && next >= end) break;
+            if (period.count() > 0) {
+                // Unlike this_thread::sleep_until(), returns early on a signal.
+                auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                              next.time_since_epoch())
+                              .count();
+                timespec ts{static_cast<time_t>(ns / 1000000000),
+                            static_cast<long>(ns % 1000000000)};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+                if (g_batch_signal) break;
+                // Don't try to catch up if the device fell behind.
+                next = max(next + period, now());
+            }
+            auto t = now();
+            if (count == 0 && t >= end) break;
+            auto data = unwrap(kt001_->GetMeterReading(&sys_err), &sys_err);
+            Write(chrono::duration_cast<chrono::microseconds>(t - start_)
+                      .count(),
+                  data);
+            Account(data);
+            if (i == 0) first = t;
+            last = t;
+        }
+        // Only time spent sampling counts towards the rate, not the gaps
+        // between runs.
+        if (i > 1) {
+            sampling_time_ += last - first;
+            intervals_ += i - 1;
+        }
+        if (fflush(out_) != 0 || ferror(out_)) {
+            Fail("failed to write readings", errno);
+        }
+        ExitIfSignalled();
+    }
+
+    void Screenshot(const string &filename) {
+        SystemError sys_err{};
+        auto ss = unwrap(kt001_->GetScreenshot(&sys_err), &sys_err);
+        if (!write_screenshot(ss, filename)) {
+            Fail("failed to write screenshot to " + filename, errno);
+        }
+        cerr << "Screenshot written to " << filename << endl;
+    }
+
+    void PrintStats() {
+        fprintf(stderr, "Samples: %llu\n",
+                static_cast<unsigned long long>(samples_));
+        if (samples_ == 0) return;
+        double elapsed = chrono::duration<double>(sampling_time_).count();
+        if (intervals_ > 0 && elapsed > 0) {
+            fprintf(stderr, "   Rate: %.3fHz\n", intervals_ / elapsed);
+        }
+        const char *names[] = {"Voltage", "Current", "  Power", "     D+",
+                               "     D-"};
+        const char *units[] = {"V", "A", "W", "V", "V"};
+        for (size_t i = 0; i < kFields; i++) {
+            fprintf(stderr, "%s: min %.05f%s max %.05f%s mean %.05f%s\n",
+                    names[i], fields_[i].min, units[i], fields_[i].max,
+                    units[i], fields_[i].sum / samples_, units[i]);
+        }
+    }
+
+    void ResetStats() {
+        samples_ = 0;
+        intervals_ = 0;
+        sampling_time_ = {};
+        for (auto &f : fields_) f = FieldStats{};
+    }
+
+    // Flush and close the output. Fails if buffered readings can't be
+    // written.
+    void Finish() {
+        if (!CloseOutput()) Fail("failed to write readings", errno);
+    }
+
+    // Flush and exit if SIGINT/SIGTERM has been received.
+    void ExitIfSignalled() {
+        if (!g_batch_signal) return;
+        Finish();
+        exit(128 + g_batch_signal);
+    }
+
+    // Execute one script line. Returns false on "exit".
+    bool Run(const string &line) {
+        ExitIfSignalled();
+        istringstream ss(line);
+        string cmd, arg;
+        ss >> cmd;
+        getline(ss >> ws, arg);
+        // Tolerate trailing blanks and CRLF line endings.
+        arg.erase(arg.find_last_not_of(" \t\r") + 1);
+        if (cmd.empty() || cmd[0] == '#') {
+            return true;
+        } else if (cmd == "exit") {
+            return false;
+        } else if (cmd == "format") {
+            if (!SetFormat(arg)) Fail("unknown format: " + arg);
+        } else if (cmd == "output") {
+            SetOutput(arg.empty() ? "-" : arg);
+        } else if (cmd == "rate") {
+            double hz = ParseNumber(cmd, arg, true);
+            if (hz > 0 && 1 / hz > kMaxSeconds) Fail("rate: too low: " + arg);
+            SetRate(hz);
+        } else if (cmd == "sample") {
+            Sample(ParseCount(cmd, arg));
+        } else if (cmd == "sample_for") {
+            double duration_s = ParseNumber(cmd, arg, false);
+            if (duration_s > kMaxSeconds) Fail("sample_for: too long: " + arg);
+            Sample(0, duration_s);
+        } else if (cmd == "screenshot") {
+            Screenshot(arg.empty() ? screenshot_filename() : arg);
+        } else if (cmd == "stats") {
+            PrintStats();
+        } else if (cmd == "reset_stats") {
+            ResetStats();
+        } else {
+            Fail("unknown command: " + cmd);
+        }
+        return true;
+    }
+
+  private:
+    static constexpr size_t kOutputBufferSize = 1 << 16;
+    static constexpr size_t kFields = 5;
+    // Periods and durations are kept well inside steady_clock::duration
+    // (about 292 years of nanoseconds) so adding them to now() can't
+    // overflow.
+    static constexpr double kMaxSeconds = 1e9;
+
+    [[noreturn]] static void Fail(const string &msg, int err_no = -1) {
+        SystemError err = err_no > 0 ? SystemError(msg, err_no)
+                                     : SystemError(msg);
+        cerr << err.ToString() << endl;
+        exit(1);
+    }
+
+    // Positive integer, as taken by "sample".
+    static uint64_t ParseCount(const string &cmd, const string &arg) {
+        char *end = nullptr;
+        errno = 0;
+        uint64_t v = strtoull(arg.c_str(), &end, 10);
+        if (arg.empty() || !isdigit(static_cast<unsigned char>(arg[0])) ||
+            *end != '\0' || errno == ERANGE || v == 0) {
+            Fail(cmd + ": expected a positive count, got \"" + arg + "\"");
+        }
+        return v;
+    }
+
+    // Finite non-negative number, as taken by "rate" and "sample_for". Zero
+    // is only accepted if `allow_zero` is set.
+    static double ParseNumber(const string &cmd, const string &arg,
+                              bool allow_zero) {
+        char *end = nullptr;
+        double v = strtod(arg.c_str(), &end);
+        if (arg.empty() || arg[0] == '-' || *end != '\0' || !isfinite(v) ||
+            v < 0 || (v == 0 && !allow_zero)) {
+            Fail(cmd + ": expected a " +
+                 (allow_zero ? "non-negative" : "positive") +
+                 " number, got \"" + arg + "\"");
+        }
+        return v;
+    }
+
+    // Returns false if the stream had a write error.
+    bool CloseOutput() {
+        if (out_ == nullptr) return true;
+        bool ok = !ferror(out_);
+        ok = fclose(out_) == 0 && ok;
+        out_ = nullptr;
+        return ok;
+    }
+
+    void Write(uint64_t time_us, const MeterReading &data) {
+        if (format_ == Format::BINARY) {
+            BinaryRecord rec{time_us, data};
+            fwrite(&rec, sizeof(rec), 1, out_);
+            return;
+        }
+        if (!header_written_) {
+            fputs("time_s,voltage_v,current_a,power_w,dplus_v,dminus_v\n",
+                  out_);
+            header_written_ = true;
+        }
+        fprintf(out_, "%llu.%06llu,%.05f,%.05f,%.05f,%.05f,%.05f\n",
+                static_cast<unsigned long long>(time_us / 1000000),
+                static_cast<unsigned long long>(time_us % 1000000),
+                data.voltage_v, data.current_a, data.power_w,
+                data.volt_dplus_v, data.volt_dminus_v);
+    }
+
+    void Account(const MeterReading &data) {
+        samples_++;
+        fields_[0].Add(data.voltage_v);
+        fields_[1].Add(data.current_a);
+        fields_[2].Add(data.power_w);
+        fields_[3].Add(data.volt_dplus_v);
+        fields_[4].Add(data.volt_dminus_v);
+    }
+
+    KT001 *kt001_;
+    chrono::steady_clock::time_point start_;
+    Format format_ = Format::CSV;
+    double rate_hz_ = 0;
+    FILE *out_ = nullptr;
+    string out_path_;
+    bool header_written_ = false;
+    bool stdout_header_written_ = false;
+    unique_ptr<char[]> buf_;
+
+    uint64_t samples_ = 0;
+    uint64_t intervals_ = 0;
+    chrono::steady_clock::duration sampling_time_{};
+    FieldStats fields_[kFields];
+};
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        cout << "Usage: " << argv[0] << " <tty_device>" << endl;
+    // Batch mode is selected by any option. Flags are turned into script
+    // lines: settings run before the `-b` script so it can override them,
+    // actions run after it.
+    string script_path;
+    ostringstream flag_settings, flag_script;
+    bool batch = false;
+    bool print_stats = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:t:r:f:o:s:Sh")) != -1) {
+        batch = true;
+        switch (opt) {
+            case 'b':
+                script_path = optarg;
+                break;
+            case 'n':
+                flag_script << "sample " << optarg << "\n";
+                break;
+            case 't':
+                flag_script << "sample_for " << optarg << "\n";
+                break;
+            case 'r':
+                flag_settings << "rate " << optarg << "\n";
+                break;
+            case 'f':
+                flag_settings << "format " << optarg << "\n";
+                break;
+            case 'o':
+                flag_settings << "output " << optarg << "\n";
+                break;
+            case 's':
+                flag_script << "screenshot " << optarg << "\n";
+                break;
+            case 'S':
+                print_stats = true;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
         return 1;
     }
-    string tty_dev = argv[1];
-    cout << "USB Multimeter device: " << tty_dev << endl;
+    string tty_dev = argv[optind];
+    // Keep stdout clean for readings in batch mode.
+    ostream &log = batch ? cerr : cout;
+    log << "USB Multimeter device: " << tty_dev << endl;
 
     SystemError sys_err{};
     KT001 kt001(unwrap(Serial::Connect(tty_dev, &sys_err), &sys_err));
-    cout << "Device connected." << endl;
+    log << "Device connected." << endl;
     size_t junk_bytes = kt001.WaitForSilence();
-    cout << "Discarded " << junk_bytes << " junk bytes" << endl;
+    log << "Discarded " << junk_bytes << " junk bytes" << endl;
 
     unwrap_inverse(kt001.Handshake());
-    cout << "Handshake successful." << endl;
+    log << "Handshake successful." << endl;
 
     std::string fw_ver = unwrap(kt001.GetFwVersion(&sys_err), &sys_err);
-    cout << "Firmware version: " << fw_ver << endl;
+    log << "Firmware version: " << fw_ver << endl;
+
+    if (batch) {
+        struct sigaction sa {};
+        sa.sa_handler = batch_signal_handler;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        Batch runner(&kt001);
+        // Returns false once "exit" is reached.
+        auto run_all = [&runner](istream &script) {
+            string line;
+            while (getline(script, line)) {
+                if (!runner.Run(line)) return false;
+            }
+            return true;
+        };
+        istringstream settings(flag_settings.str());
+        bool running = run_all(settings);
+        if (running && !script_path.empty()) {
+            ifstream script_file;
+            istream *script = &cin;
+            if (script_path != "-") {
+                script_file.open(script_path);
+                if (!script_file) {
+                    cerr << "failed to open " << script_path << endl;
+                    return 1;
+                }
+                script = &script_file;
+            }
+            running = run_all(*script);
+        }
+        istringstream actions(flag_script.str());
+        if (running) run_all(actions);
+        if (print_stats) runner.PrintStats();
+        runner.Finish();
+        return 0;
+    }
+
+    // Unbuffered, so that lines typed ahead stay in the fd where
+    // stdin_ready() can see them.
+    setvbuf(stdin, nullptr, _IONBF, 0);
 
     while (true) {
         string cmd;
         cout << "cmd > ";
         cout.flush();
-        getline(cin, cmd);
-        if (cmd == "exit") {
+        if (!getline(cin, cmd) || cmd == "exit") {
             break;
         } else if (cmd == "get_meter_data") {
             auto data = unwrap(kt001.GetMeterReading(&sys_err), &sys_err);
@@ -63,8 +513,9 @@ int main(int argc, char *argv[]) {
             printf("     D+: %6.05fV\n", data.volt_dplus_v);
             printf("     D-: %6.05fV\n", data.volt_dminus_v);
         } else if (cmd == "monitor") {
+            cout << "Press Enter to stop." << endl;
             bool printed = false;
-            while (true) {
+            while (!stdin_ready()) {
 #define CLEAR_LINE "\033[2K"
 #define CURSOR_UP "\033[1A"
 #define CURSOR_LINE_HEAD "\r"
@@ -82,7 +533,8 @@ int main(int argc, char *argv[]) {
                 cout.flush();
                 printed = true;
             }
-            cout << endl;
+            string discard;
+            getline(cin, discard);
         } else if (cmd == "get_ext_record") {
             auto data = unwrap(kt001.GetRecordExistence(&sys_err), &sys_err);
             auto print = [&data](RecordIndex idx) {
@@ -96,26 +548,13 @@ int main(int argc, char *argv[]) {
         } else if (cmd == "get_screenshot") {
             KT001::Screenshot ss =
                 unwrap(kt001.GetScreenshot(&sys_err), &sys_err);
-            char time_str[80];
-            time_t t = time(nullptr);
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d-%H%M%S",
-                     localtime(&t));
-            string filename = string{time_str} + ".ppm";
+            string filename = screenshot_filename();
             cout << "Writing to " << filename << endl;
-            ofstream img(filename.c_str());
-            img << "P3" << endl;
-            img << ss.width << " " << ss.height << endl;
-            img << "255" << endl;
-            for (size_t y = 0; y < ss.height; y++) {
-                for (size_t x = 0; x < ss.width; x++) {
-                    size_t idx = y * ss.width + x;
-                    img << static_cast<int>(ss.data[idx * 3]) << " "
-                        << static_cast<int>(ss.data[idx * 3 + 1]) << " "
-                        << static_cast<int>(ss.data[idx * 3 + 2]) << endl;
-                }
+            if (write_screenshot(ss, filename)) {
+                cout << "Written." << endl;
+            } else {
+                cout << "Failed to write " << filename << endl;
             }
-            img.close();
-            cout << "Written." << endl;
         } else {
             auto maybe_reply = kt001.RawCommand(cmd, &sys_err);
             if (maybe_reply) {